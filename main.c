@@ -13,6 +13,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -22,29 +23,88 @@
 #include <assert.h>
 #include <ctype.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include "proxy_log.h"
 #include "proxy_core.h"
+#include "proxy_sched.h"
+#include "proxy_trace.h"
+#include "proxy_config.h"
+#include "proxy_cache.h"
+#include "proxy_warm.h"
 #include "proxy_def.h"
 
 pthread_mutex_t proxy_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ Signal thread body. Dumps the request traces on SIGUSR1, and reloads the
+ configuration on SIGHUP.
+ 
+ @param ptr Pointer to the listen socket
+*/
+static void* signal_thread(void* ptr) {
+	int listen_socket = *(int*)ptr;
+	struct proxy_config cfg;
+	sigset_t set;
+	int sig;
+	
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGHUP);
+	
+	while(1) {
+		if(sigwait(&set, &sig)) continue;
+		
+		if(sig == SIGUSR1) {
+			if(trace_dump(TRACE_FILE)) fprintf(stderr, "x- Couldn't write trace to %s\n", TRACE_FILE);
+			else printf("-- Wrote recent request traces to %s\n", TRACE_FILE);
+		}
+		else if(sig == SIGHUP) {
+			if(config_reload()) {
+				fprintf(stderr, "x- Configuration not reloaded, keeping current settings\n");
+				continue;
+			}
+			config_get(&cfg);
+			
+			// Calling listen() again on a listening socket changes its backlog
+			if(listen(listen_socket, cfg.backlog) == -1) perror("listen");
+			sched_configure(&cfg);
+			cache_configure(&cfg);
+			printf("-- Configuration reloaded\n");
+		}
+	}
+	
+	return 0;
+}
+
 int main(int argc, const char * argv[]) {
 	
-	// Make sure the request store is large enough to store a request
-	if(DEBUG_ON) assert(MAX_RECV <= MAX_REQUEST_SIZE);
+	struct proxy_config cfg; // Copy of the settings currently in use
 	
 	/////////////////////////////////////////////////////////////
-	// Check for enough command line arguments (should be one) //
+	// Check for enough command line arguments (at least one)  //
 	/////////////////////////////////////////////////////////////
 	if (argc < 2) {
-		fprintf(stderr, "Usage: <port-number>\n");
+		fprintf(stderr, "Usage: <port-number> [-c config-file] [setting=value ...]\n");
 		exit(1);
 	}
 	/////////////////////////////////////////////////////////////
 	/////////////////////////////////////////////////////////////
 	
-	if(DEBUG_ON) assert(argc >= 2);
+	////////////////////////////////////////////////////////
+	// Read the configuration file and command line       //
+	// overrides that follow the port number.             //
+	////////////////////////////////////////////////////////
+	if(config_init(argc - 2, &argv[2])) {
+		fprintf(stderr, "Usage: <port-number> [-c config-file] [setting=value ...]\n");
+		exit(1);
+	}
+	config_get(&cfg);
+	////////////////////////////////////////////////////////
+	////////////////////////////////////////////////////////
+	
+	// Make sure the request store is large enough to store a request
+	if(cfg.debug) assert(cfg.recv_size <= cfg.request_size);
+	
+	if(cfg.debug) assert(argc >= 2);
 	
 	///////////////////////////////////////////////////////////
 	// Get port number from argument and check it for errors //
@@ -75,7 +135,7 @@ int main(int argc, const char * argv[]) {
 	///////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////
 	
-	if(DEBUG_ON) assert(port_number <= MAX_PORT);
+	if(cfg.debug) assert(port_number <= MAX_PORT);
 	
 	// Store string version of port number
 	const char* port_number_str = argv[1];
@@ -102,9 +162,11 @@ int main(int argc, const char * argv[]) {
 	//////////////////////////////////////////////////
 	// Setup log file. If we can't create log file, //
 	// the program will just continue with logging  //
-	// disabled instead of exiting.                 //
+	// disabled instead of exiting. The file is     //
+	// appended to, so earlier runs' history stays  //
+	// available to replay as a warmup_file.        //
 	//////////////////////////////////////////////////
-	proxy_log = fopen("proxy.log", "w+");
+	proxy_log = fopen("proxy.log", "a");
 	if(!proxy_log) {
 		printf("x- Could not create logging file. Logging disabled.\n");
 		no_logging = 1;
@@ -199,7 +261,7 @@ int main(int argc, const char * argv[]) {
 	////////////////////////////////////////////////////////
 	// Tell the socket to begin listening for connections //
 	////////////////////////////////////////////////////////
-	if (listen(listen_socket, MAX_WAITING) == -1) {
+	if (listen(listen_socket, cfg.backlog) == -1) {
         perror("listen");
         exit(1);
     }
@@ -218,8 +280,8 @@ int main(int argc, const char * argv[]) {
 	
 	long int bytes_received; // The number of bytes returned by recv()
 	int recv_err; // Flag set if some error occurs when receiving the request
-	const int req_slots = MAX_REQUEST_SIZE + 1; // Size of the request string buffer
-	char incoming_request[req_slots]; // Stores the request string
+	int req_slots = 0; // Size of the request string buffer
+	char* incoming_request = NULL; // Stores the request string
 	char* target_hostname; // Stores the URL of the target webserver
 	long int hostname_len; // Stores the length of target_hostname
 	socket_address client_addr; // Used to store the client's address
@@ -227,14 +289,33 @@ int main(int argc, const char * argv[]) {
 	char* req_point; // Used to traverse the request buffer
 	int reqlen; // Tracks the length of the request string in bytes
 	rb request; // GET request structure
-	pthread_t thread; // Create a thread
-	sem_t semaphore; // Used to limit number of threads that get/send at once
+	unsigned long req_id = 0; // Id of the current request, used to trace it
+	sigset_t signals; // Signals handled by the signal thread
+	pthread_t sig_thread; // Thread that handles signals
 	
-	// Initialise the semaphore to only allow MAX_THREADS to run the get_and_send function
-	sem_init(&semaphore, 0, MAX_THREADS);
+	//////////////////////////////////////////////////////
+	// Block the signals in this thread before any other //
+	// thread exists, so every thread inherits the mask  //
+	// and only the signal thread receives them.         //
+	//////////////////////////////////////////////////////
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if(pthread_create(&sig_thread, 0, signal_thread, &listen_socket)) {
+		perror("pthread_create");
+		exit(1);
+	}
+	pthread_detach(sig_thread);
+	//////////////////////////////////////////////////////
+	//////////////////////////////////////////////////////
+	
+	// Start the workers to run the get_and_send function
+	sched_configure(&cfg);
 	
-	// Zero the incoming request string
-	memset(incoming_request, 0, req_slots);
+	// Size the cache, and start filling it from the warmup file
+	cache_configure(&cfg);
+	warm_init();
 	
 	/////////////////////////////////////////////////////////////
 	// Begin the main function fo the proxy, where connections //
@@ -243,7 +324,18 @@ int main(int argc, const char * argv[]) {
 	// ver until the process is terminated or on error.        //
 	/////////////////////////////////////////////////////////////
 	while(1) {
-		printf("\n- Proxy now running. Listening for incoming connections...\n");
+		// Pick up any reloaded settings
+		config_get(&cfg);
+		if(req_slots != cfg.request_size + 1) {
+			req_slots = cfg.request_size + 1;
+			incoming_request = (char*)realloc(incoming_request, req_slots);
+			if(!incoming_request) {
+				fprintf(stderr, "x- Couldn't allocate request buffer\n");
+				exit(1);
+			}
+		}
+		
+		if(cfg.verbose) printf("\n- Proxy now running. Listening for incoming connections...\n");
 		// Reset variables used in the accept phase
 		recv_err = 0;
 		connect_socket = 0;
@@ -264,13 +356,22 @@ int main(int argc, const char * argv[]) {
             continue;
         }
 		
+		req_id++;
+		trace_event(req_id, TRACE_ACCEPT);
+		
+		// Don't let a slow client hold up the accept loop forever
+		if(cfg.client_timeout > 0) {
+			struct timeval tv = { cfg.client_timeout, 0 };
+			setsockopt(connect_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		}
+		
 		/////////////////////////////////////////////////////
 		// Convert the IP address (v4 OR v6) of the client //
 		// into human readable form and print it.          //
 		/////////////////////////////////////////////////////
         inet_ntop(client_addr.ss_family, get_in_addr((sa_p)&client_addr), ip_str, sizeof(ip_str));
 
-		printf("-- Received connection from client at %s\n", ip_str);
+		if(cfg.verbose) printf("-- Received connection from client at %s\n", ip_str);
 		
 		///////////////////////////////////////////////////////
 		// Final check to make sure connect socket was bound //
@@ -279,6 +380,7 @@ int main(int argc, const char * argv[]) {
 		if(connect_socket <= 0) {
 			fprintf(stderr, "x- Couldn't bind connection socket\n");
 			close(connect_socket);
+			trace_event(req_id, TRACE_DONE);
 			continue;
 		}
 		///////////////////////////////////////////////////////
@@ -289,17 +391,17 @@ int main(int argc, const char * argv[]) {
 		/////////////////////////////////////////
 		req_point = incoming_request; // Set the request string pointer to the start of the buffer
 		memset(incoming_request, 0, req_slots); // Zero the buffer
-		printf("-- Receiving request from %s\n", ip_str);
+		if(cfg.verbose) printf("-- Receiving request from %s\n", ip_str);
 		
 		while(1) {
 			// Receive part/whole request
-			bytes_received = recv(connect_socket, req_point, MAX_RECV, 0);
+			bytes_received = recv(connect_socket, req_point, cfg.recv_size, 0);
 			reqlen += bytes_received;
 			
 			if(bytes_received == 0 || has_req_end(incoming_request)) {
 				// Connection was closed by client, or the end of request detected
 				
-				if(reqlen > MAX_REQUEST_SIZE) {
+				if(reqlen > cfg.request_size) {
 					//Request is too long for our buffer
 					printf("x- Request from %s too long, closing connection", ip_str);
 					recv_err = 1;
@@ -316,7 +418,7 @@ int main(int argc, const char * argv[]) {
 				break;
 			}
 			
-			if(DEBUG_ON) assert(reqlen < req_slots);
+			if(cfg.debug) assert(reqlen < req_slots);
 		}
 		/////////////////////////////////////////
 		/////////////////////////////////////////
@@ -327,12 +429,13 @@ int main(int argc, const char * argv[]) {
 		///////////////////////////////////////////////////////////
 		if(recv_err) {
 			close(connect_socket);
+			trace_event(req_id, TRACE_DONE);
 			continue;
 		}
 		///////////////////////////////////////////////////////////
 		///////////////////////////////////////////////////////////
 		
-		printf("-- Request from %s fully received\n", ip_str);
+		if(cfg.verbose) printf("-- Request from %s fully received\n", ip_str);
 		
 		//////////////////////////////////////////////////////////
 		// Buffer contains whole request, so grab the hostname. //
@@ -349,9 +452,12 @@ int main(int argc, const char * argv[]) {
 			// Malformed header
 			fprintf(stderr, "x- Malformed header for client IP %s. Request body follows:\n--------------\n'%s'\n---------------\n", ip_str, incoming_request);
 			close(connect_socket);
+			trace_event(req_id, TRACE_DONE);
 			continue;
 		}
 		
+		trace_event(req_id, TRACE_PARSED);
+		
 		// Rename the URL string for clarity
 		target_hostname = req_pointer;
 		hostname_len = strlen(target_hostname);
@@ -363,7 +469,7 @@ int main(int argc, const char * argv[]) {
 		// receive the response, and forward it back to our    //
 		// client.                                             //
 		/////////////////////////////////////////////////////////
-		printf("-- Beginning request from %s to target server at %s...\n", ip_str, target_hostname);
+		if(cfg.verbose) printf("-- Beginning request from %s to target server at %s...\n", ip_str, target_hostname);
 		
 		// Fill out our request structure
 		request = (rb)malloc(sizeof(struct request_body));
@@ -376,12 +482,11 @@ int main(int argc, const char * argv[]) {
 		request->file = (char*)calloc(sizeof(char), (strlen(INDEX_FILE) + NULL_CHAR));
 		strcpy(request->file, INDEX_FILE);
 		request->nolog = no_logging;
+		request->id = req_id;
+		request->cached = NULL;
 		
-		// Use the semaphore to control traffic
-		sem_wait(&semaphore);
-		pthread_create(&thread, 0, get_and_send, (void *)request);
-		pthread_detach(thread);
-		sem_post(&semaphore);
+		// Queue the request on its origin, the scheduler shares the workers fairly between origins
+		sched_submit(request);
 		///////////////////////////////////////////////////////////////
 		///////////////////////////////////////////////////////////////
 		
@@ -391,7 +496,7 @@ int main(int argc, const char * argv[]) {
 	
 	// Clean up
 	pthread_mutex_destroy(&proxy_mutex);
-	sem_destroy(&semaphore);
+	free(incoming_request);
     return 0;
 }
 
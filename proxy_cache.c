@@ -0,0 +1,447 @@
+#define _GNU_SOURCE // strptime() and timegm()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "proxy_cache.h"
+#include "proxy_sketch.h"
+#include "proxy_core.h"
+#include "proxy_def.h"
+
+pthread_mutex_t proxy_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct cache_entry* cache_buckets[CACHE_BUCKETS]; // Hash table of cached responses
+struct cache_list cache_lists[2]; // The admission window and the main cache, indexed by segment
+struct sketch cache_sketch; // How often each key has been asked for recently, hit or miss
+int cache_ttl = CACHE_TTL; // Seconds a response without freshness headers stays fresh, 0 for forever
+
+/*
+ Frees an entry once nothing refers to it any more.
+ Must be called with proxy_cache_mutex held.
+
+ @param e The entry
+*/
+static void entry_unref(struct cache_entry* e) {
+	if(--e->refs) return;
+
+	free(e->key);
+	free(e->body);
+	free(e);
+}
+
+/*
+ Adds an entry to the front of a segment's LRU list.
+ Must be called with proxy_cache_mutex held.
+
+ @param e The entry
+ @param segment CACHE_WINDOW or CACHE_MAIN
+*/
+static void list_push(struct cache_entry* e, int segment) {
+	struct cache_list* l = &cache_lists[segment];
+
+	e->segment = segment;
+	e->prev = NULL;
+	e->next = l->head;
+	if(l->head) l->head->prev = e;
+	else l->tail = e;
+	l->head = e;
+	l->bytes += e->size;
+}
+
+/*
+ Takes an entry out of its segment's LRU list.
+ Must be called with proxy_cache_mutex held.
+
+ @param e The entry
+*/
+static void list_unlink(struct cache_entry* e) {
+	struct cache_list* l = &cache_lists[e->segment];
+
+	if(e->prev) e->prev->next = e->next;
+	else l->head = e->next;
+	if(e->next) e->next->prev = e->prev;
+	else l->tail = e->prev;
+	e->prev = e->next = NULL;
+	l->bytes -= e->size;
+}
+
+/*
+ Takes an entry out of the hash table and drops the cache's reference to it.
+ Readers still holding the entry can keep using it until they release it.
+ Must be called with proxy_cache_mutex held.
+
+ @param e The entry, which must not be in an LRU list
+*/
+static void entry_drop(struct cache_entry* e) {
+	struct cache_entry** link = &cache_buckets[e->hash % CACHE_BUCKETS];
+
+	while(*link != e) link = &(*link)->hnext;
+	*link = e->hnext;
+
+	entry_unref(e);
+}
+
+/*
+ Removes an entry from the cache.
+ Must be called with proxy_cache_mutex held.
+
+ @param e The entry
+*/
+static void entry_remove(struct cache_entry* e) {
+	list_unlink(e);
+	entry_drop(e);
+}
+
+/*
+ Decides whether an entry pushed out of the admission window may enter the
+ main cache. The least recently used main entries that would have to be
+ evicted to make room are totalled up, and the candidate only gets in if
+ the sketch says it is asked for more often than all of them together. One
+ large response can't push out many popular small ones, and responses that
+ are only asked for once never displace anything.
+ Must be called with proxy_cache_mutex held.
+
+ @param cand The entry, which must not be in an LRU list
+*/
+static void admit(struct cache_entry* cand) {
+	struct cache_list* main_list = &cache_lists[CACHE_MAIN];
+	struct cache_entry* victim;
+	long freed = 0;
+	int victims_freq = 0, victims = 0;
+
+	if(cand->size > main_list->budget) {
+		entry_drop(cand);
+		return;
+	}
+
+	for(victim = main_list->tail; victim && main_list->bytes - freed + cand->size > main_list->budget; victim = victim->prev) {
+		freed += victim->size;
+		victims_freq += sketch_estimate(&cache_sketch, victim->hash);
+		victims++;
+	}
+
+	if(victims && sketch_estimate(&cache_sketch, cand->hash) <= victims_freq) {
+		entry_drop(cand);
+		return;
+	}
+
+	while(main_list->tail && main_list->bytes + cand->size > main_list->budget) entry_remove(main_list->tail);
+	list_push(cand, CACHE_MAIN);
+}
+
+/*
+ Splits a byte budget between the admission window and the main cache, and
+ evicts least recently used entries from each until they fit.
+ Must be called with proxy_cache_mutex held.
+
+ @param budget Most bytes the cache may hold
+*/
+static void set_budget(long budget) {
+	struct cache_list* window = &cache_lists[CACHE_WINDOW];
+	struct cache_list* main_list = &cache_lists[CACHE_MAIN];
+
+	window->budget = budget * CACHE_WINDOW_PERCENT / 100;
+	main_list->budget = budget - window->budget;
+
+	while(window->bytes > window->budget) entry_remove(window->tail);
+	while(main_list->bytes > main_list->budget) entry_remove(main_list->tail);
+}
+
+/*
+ Looks up a cached response, and counts the request in the frequency
+ sketch whether or not it hits. Stale entries are dropped rather than
+ returned.
+
+ @param key The cache key of the response
+
+ @returns The entry, which must be handed back with cache_release(), or NULL on a miss
+*/
+struct cache_entry* cache_get(const char* key) {
+	unsigned long hash = hash_string(key);
+	struct cache_entry* e;
+
+	pthread_mutex_lock(&proxy_cache_mutex);
+	sketch_increment(&cache_sketch, hash);
+
+	for(e = cache_buckets[hash % CACHE_BUCKETS]; e; e = e->hnext) {
+		if(e->hash == hash && !strcmp(e->key, key)) break;
+	}
+
+	if(e && e->expires && time(NULL) >= e->expires) {
+		entry_remove(e);
+		e = NULL;
+	}
+
+	if(e) {
+		// Move to the front of its LRU list
+		list_unlink(e);
+		list_push(e, e->segment);
+		e->refs++;
+	}
+	pthread_mutex_unlock(&proxy_cache_mutex);
+
+	return e;
+}
+
+/*
+ Checks whether a fresh copy of a response is cached. Unlike cache_get()
+ this is not counted as a request, so the frequency sketch and the LRU
+ order only ever reflect what clients ask for.
+
+ @param key The cache key of the response
+
+ @returns 1 if the response is cached and fresh, or 0 otherwise
+*/
+int cache_contains(const char* key) {
+	unsigned long hash = hash_string(key);
+	struct cache_entry* e;
+
+	pthread_mutex_lock(&proxy_cache_mutex);
+	for(e = cache_buckets[hash % CACHE_BUCKETS]; e; e = e->hnext) {
+		if(e->hash == hash && !strcmp(e->key, key)) break;
+	}
+
+	if(e && e->expires && time(NULL) >= e->expires) {
+		entry_remove(e);
+		e = NULL;
+	}
+	pthread_mutex_unlock(&proxy_cache_mutex);
+
+	return e != NULL;
+}
+
+/*
+ Hands back an entry returned by cache_get()
+
+ @param e The entry
+*/
+void cache_release(struct cache_entry* e) {
+	pthread_mutex_lock(&proxy_cache_mutex);
+	entry_unref(e);
+	pthread_mutex_unlock(&proxy_cache_mutex);
+}
+
+/*
+ Adds a response to the cache, replacing any older copy. New responses go
+ into the admission window, and whatever the window pushes out has to win
+ its place in the main cache through admit().
+
+ @param key The cache key of the response
+ @param body The response, which the cache takes ownership of
+ @param len Length of the response in bytes
+ @param lifetime Seconds the response stays fresh, from cache_cacheable(), or -1 to use cache_ttl
+*/
+void cache_insert(const char* key, char* body, long len, long lifetime) {
+	struct cache_list* window = &cache_lists[CACHE_WINDOW];
+	unsigned long hash = hash_string(key);
+	struct cache_entry* e;
+	long size = len + strlen(key) + NULL_CHAR + sizeof(struct cache_entry);
+
+	pthread_mutex_lock(&proxy_cache_mutex);
+	if(size > window->budget + cache_lists[CACHE_MAIN].budget) {
+		pthread_mutex_unlock(&proxy_cache_mutex);
+		free(body);
+		return;
+	}
+
+	for(e = cache_buckets[hash % CACHE_BUCKETS]; e; e = e->hnext) {
+		if(e->hash == hash && !strcmp(e->key, key)) {
+			entry_remove(e);
+			break;
+		}
+	}
+
+	e = (struct cache_entry*)calloc(1, sizeof(struct cache_entry));
+	if(e) e->key = (char*)calloc(sizeof(char), strlen(key) + NULL_CHAR);
+	if(!e || !e->key) {
+		pthread_mutex_unlock(&proxy_cache_mutex);
+		if(e) free(e);
+		free(body);
+		return;
+	}
+	strcpy(e->key, key);
+	e->hash = hash;
+	e->body = body;
+	e->len = len;
+	e->size = size;
+	if(lifetime >= 0) e->expires = time(NULL) + lifetime;
+	else e->expires = cache_ttl ? time(NULL) + cache_ttl : 0;
+	e->refs = 1;
+
+	e->hnext = cache_buckets[hash % CACHE_BUCKETS];
+	cache_buckets[hash % CACHE_BUCKETS] = e;
+
+	if(size > window->budget) {
+		// Too big for the window, so it goes straight to admission
+		admit(e);
+	}
+	else {
+		list_push(e, CACHE_WINDOW);
+		while(window->bytes > window->budget) {
+			struct cache_entry* cand = window->tail;
+			list_unlink(cand);
+			admit(cand);
+		}
+	}
+	pthread_mutex_unlock(&proxy_cache_mutex);
+}
+
+/*
+ Copies a header's value into a buffer, trimmed and lower cased if asked
+
+ @param value Start of the value, just after the ':'
+ @param len Length of the value in bytes
+ @param buf The buffer, MAX_HEADER_VALUE + NULL_CHAR bytes long
+ @param lower Set to lower case the value
+*/
+static void header_copy(const char* value, long len, char* buf, int lower) {
+	long i, n = 0;
+
+	while(len && isspace((unsigned char)*value)) {
+		value++;
+		len--;
+	}
+	for(i = 0; i < len && n < MAX_HEADER_VALUE; i++) buf[n++] = lower ? tolower((unsigned char)value[i]) : value[i];
+	while(n && isspace((unsigned char)buf[n - 1])) n--;
+	buf[n] = '\0';
+}
+
+/*
+ Parses an HTTP date (RFC 1123 format)
+
+ @param str The date
+
+ @returns The date, or -1 if it could not be parsed
+*/
+static time_t parse_http_date(const char* str) {
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if(!strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return -1;
+
+	return timegm(&tm);
+}
+
+/*
+ Reads the number following a Cache-Control directive such as "max-age="
+
+ @param cc The lower cased Cache-Control value
+ @param directive The directive, including the '='
+
+ @returns The number, or -1 if the directive is missing or invalid
+*/
+static long cache_control_seconds(const char* cc, const char* directive) {
+	const char* at = strstr(cc, directive);
+	char* end;
+	long v;
+
+	if(!at) return -1;
+
+	v = strtol(at + strlen(directive), &end, BASE_TEN);
+	if(end == at + strlen(directive) || v < 0) return -1;
+
+	return v;
+}
+
+/*
+ Checks whether a response may be kept in a cache shared between clients.
+ Only complete "200" responses are kept. Responses that set cookies, or
+ that Cache-Control marks no-store, private or no-cache, are never kept,
+ since they may be meant for one client only. How long the response stays
+ fresh comes from s-maxage, max-age or Expires, in that order, less its Age.
+
+ @param body The response
+ @param len Length of the response in bytes
+ @param lifetime Set to the seconds the response stays fresh, or -1 if the headers don't say
+
+ @returns 1 if the response can be cached, or 0 otherwise
+*/
+int cache_cacheable(const char* body, long len, long* lifetime) {
+	const char* status = memchr(body, ' ', len < 16 ? len : 16);
+	const char *line, *eol, *hdr_end = NULL;
+	char value[MAX_HEADER_VALUE + NULL_CHAR];
+	long max_age = -1, s_maxage = -1, age = 0, i;
+	char* end;
+	time_t date = -1, expires = -1;
+	int has_expires = 0;
+
+	*lifetime = -1;
+
+	if(len < 12 || strncmp(body, "HTTP/1.", 7) || !status || status + 4 > body + len) return 0;
+	if(strncmp(status + 1, "200", 3)) return 0;
+
+	// Find the end of the headers
+	for(i = 0; i + 4 <= len; i++) {
+		if(!memcmp(&body[i], "\r\n\r\n", 4)) {
+			hdr_end = &body[i];
+			break;
+		}
+	}
+	if(!hdr_end) return 0;
+
+	// Skip the status line, whose CRLF is the start of hdr_end if there are no headers
+	line = memchr(body, '\n', hdr_end + 2 - body);
+	if(!line) return 0;
+	line++;
+
+	while(line < hdr_end) {
+		eol = memchr(line, '\r', hdr_end - line);
+		if(!eol) eol = hdr_end;
+
+		if(!strncasecmp(line, "set-cookie:", 11)) return 0;
+		else if(!strncasecmp(line, "cache-control:", 14)) {
+			header_copy(line + 14, eol - line - 14, value, 1);
+			if(strstr(value, "no-store") || strstr(value, "private") || strstr(value, "no-cache")) return 0;
+			if(max_age < 0) max_age = cache_control_seconds(value, "max-age=");
+			if(s_maxage < 0) s_maxage = cache_control_seconds(value, "s-maxage=");
+		}
+		else if(!strncasecmp(line, "expires:", 8)) {
+			header_copy(line + 8, eol - line - 8, value, 0);
+			expires = parse_http_date(value);
+			has_expires = 1;
+		}
+		else if(!strncasecmp(line, "date:", 5)) {
+			header_copy(line + 5, eol - line - 5, value, 0);
+			date = parse_http_date(value);
+		}
+		else if(!strncasecmp(line, "age:", 4)) {
+			header_copy(line + 4, eol - line - 4, value, 0);
+			age = strtol(value, &end, BASE_TEN);
+			if(end == value || age < 0) age = 0;
+		}
+
+		line = eol + 2;
+	}
+
+	if(s_maxage >= 0) *lifetime = s_maxage;
+	else if(max_age >= 0) *lifetime = max_age;
+	else if(has_expires) {
+		// An invalid Expires means already expired
+		if(expires < 0) return 0;
+		*lifetime = expires - (date >= 0 ? date : time(NULL));
+		if(*lifetime < 0) return 0;
+	}
+
+	// Time already spent in upstream caches comes off the lifetime
+	if(*lifetime >= 0) {
+		*lifetime -= age;
+		if(*lifetime <= 0) return 0;
+	}
+
+	return 1;
+}
+
+/*
+ Applies the cache settings, evicting entries if the budget has shrunk
+
+ @param cfg The settings to apply
+*/
+void cache_configure(struct proxy_config* cfg) {
+	pthread_mutex_lock(&proxy_cache_mutex);
+	set_budget(cfg->cache_size);
+	cache_ttl = cfg->cache_ttl;
+	pthread_mutex_unlock(&proxy_cache_mutex);
+}
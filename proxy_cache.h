@@ -0,0 +1,43 @@
+
+#ifndef proxy_proxy_cache_h
+#define proxy_proxy_cache_h
+
+#include <time.h>
+#include "proxy_config.h"
+
+#define CACHE_BUCKETS 4096
+#define CACHE_WINDOW_PERCENT 1 // Share of the budget given to the admission window
+#define MAX_HEADER_VALUE 255
+
+#define CACHE_WINDOW 0
+#define CACHE_MAIN 1
+
+struct cache_entry {
+	char* key;
+	unsigned long hash;
+	char* body; // The whole response, headers included
+	long len; // Length of body in bytes
+	long size; // Bytes charged against the cache budget
+	time_t expires; // When the response goes stale, 0 for never
+	int refs; // Readers holding the entry, plus one while it is in the cache
+	int segment; // CACHE_WINDOW or CACHE_MAIN
+	struct cache_entry* hnext; // Next entry in the same hash bucket
+	struct cache_entry* prev; // More recently used entry
+	struct cache_entry* next; // Less recently used entry
+};
+
+struct cache_list {
+	struct cache_entry* head; // Most recently used entry
+	struct cache_entry* tail; // Least recently used entry
+	long bytes; // Bytes charged for the entries in the list
+	long budget; // Most bytes the list may hold
+};
+
+struct cache_entry* cache_get(const char* key);
+int cache_contains(const char* key);
+void cache_release(struct cache_entry* e);
+void cache_insert(const char* key, char* body, long len, long lifetime);
+int cache_cacheable(const char* body, long len, long* lifetime);
+void cache_configure(struct proxy_config* cfg);
+
+#endif
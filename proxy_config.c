@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "proxy_config.h"
+#include "proxy_def.h"
+
+pthread_mutex_t proxy_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct proxy_config proxy_config; // The settings currently in use
+const char* config_path = NULL; // The configuration file, or NULL if there isn't one
+int config_argc = 0; // Number of setting=value overrides from the command line
+const char** config_argv = NULL; // The setting=value overrides from the command line
+
+#define CONFIG_INT 0
+#define CONFIG_STR 1
+
+struct config_key {
+	const char* name;
+	int type; // CONFIG_INT or CONFIG_STR
+	size_t offset; // Offset of the setting in struct proxy_config
+	int min; // Smallest allowed value
+	int max; // Largest allowed value
+};
+
+static const struct config_key config_keys[] = {
+	{"backlog", CONFIG_INT, offsetof(struct proxy_config, backlog), 1, 65535},
+	{"recv_size", CONFIG_INT, offsetof(struct proxy_config, recv_size), 1, 1048576},
+	{"request_size", CONFIG_INT, offsetof(struct proxy_config, request_size), 16, 1048576},
+	{"threads", CONFIG_INT, offsetof(struct proxy_config, threads), 1, THREADS_LIMIT},
+	{"max_file_size", CONFIG_INT, offsetof(struct proxy_config, max_file_size), 0, 1073741824},
+	{"debug", CONFIG_INT, offsetof(struct proxy_config, debug), 0, 1},
+	{"verbose", CONFIG_INT, offsetof(struct proxy_config, verbose), 0, 1},
+	{"per_origin", CONFIG_INT, offsetof(struct proxy_config, per_origin), 1, 1024},
+	{"origin_queue", CONFIG_INT, offsetof(struct proxy_config, origin_queue), 1, 65535},
+	{"breaker_threshold", CONFIG_INT, offsetof(struct proxy_config, breaker_threshold), 1, 65535},
+	{"breaker_cooldown", CONFIG_INT, offsetof(struct proxy_config, breaker_cooldown), 0, 86400},
+	{"upstream_timeout", CONFIG_INT, offsetof(struct proxy_config, upstream_timeout), 0, 86400},
+	{"client_timeout", CONFIG_INT, offsetof(struct proxy_config, client_timeout), 0, 86400},
+	{"cache_size", CONFIG_INT, offsetof(struct proxy_config, cache_size), 0, 2147483647},
+	{"cache_ttl", CONFIG_INT, offsetof(struct proxy_config, cache_ttl), 0, 31536000},
+	{"warmup_file", CONFIG_STR, offsetof(struct proxy_config, warmup_file), 0, MAX_CONFIG_LINE - 1},
+	{"warmup_rate", CONFIG_INT, offsetof(struct proxy_config, warmup_rate), 1, 10000},
+	{"prefetch", CONFIG_INT, offsetof(struct proxy_config, prefetch), 0, 1},
+	{"prefetch_links", CONFIG_INT, offsetof(struct proxy_config, prefetch_links), 0, 1024},
+	{NULL, 0, 0, 0, 0}
+};
+
+/*
+ Fills a configuration with the compiled in defaults
+
+ @param cfg The configuration to fill
+*/
+static void config_defaults(struct proxy_config* cfg) {
+	cfg->backlog = MAX_WAITING;
+	cfg->recv_size = MAX_RECV;
+	cfg->request_size = MAX_REQUEST_SIZE;
+	cfg->threads = MAX_THREADS;
+	cfg->max_file_size = MAX_FILE_SIZE;
+	cfg->debug = DEBUG_ON;
+	cfg->verbose = VERBOSE_ON;
+	cfg->per_origin = MAX_PER_ORIGIN;
+	cfg->origin_queue = MAX_ORIGIN_QUEUE;
+	cfg->breaker_threshold = BREAKER_THRESHOLD;
+	cfg->breaker_cooldown = BREAKER_COOLDOWN;
+	cfg->upstream_timeout = UPSTREAM_TIMEOUT;
+	cfg->client_timeout = CLIENT_TIMEOUT;
+	cfg->cache_size = CACHE_SIZE;
+	cfg->cache_ttl = CACHE_TTL;
+	strcpy(cfg->warmup_file, WARMUP_FILE);
+	cfg->warmup_rate = WARMUP_RATE;
+	cfg->prefetch = PREFETCH_ON;
+	cfg->prefetch_links = PREFETCH_LINKS;
+}
+
+/*
+ Strips leading and trailing whitespace from a string
+
+ @param str The string
+
+ @returns Pointer to the first non-whitespace character of str
+*/
+static char* trim(char* str) {
+	char* end;
+
+	while(isspace((unsigned char)*str)) str++;
+
+	end = str + strlen(str);
+	while(end > str && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+
+	return str;
+}
+
+/*
+ Sets a single setting from its name and a string value
+
+ @param cfg The configuration to change
+ @param key The name of the setting
+ @param value The new value, as a string
+
+ @returns 0 on success, or -1 if the setting is unknown or the value is invalid
+*/
+static int config_set(struct proxy_config* cfg, const char* key, const char* value) {
+	const struct config_key* k;
+	char* end;
+	long v;
+
+	for(k = config_keys; k->name; k++) {
+		if(strcmp(k->name, key)) continue;
+
+		if(k->type == CONFIG_STR) {
+			if(strlen(value) > (size_t)k->max) {
+				fprintf(stderr, "x- Setting %s must be at most %d characters\n", key, k->max);
+				return -1;
+			}
+			strcpy((char*)cfg + k->offset, value);
+			return 0;
+		}
+
+		errno = 0;
+		v = strtol(value, &end, BASE_TEN);
+		if(errno || end == value || *end != '\0') {
+			fprintf(stderr, "x- Invalid value '%s' for setting %s, please only enter numbers\n", value, key);
+			return -1;
+		}
+		if(v < k->min || v > k->max) {
+			fprintf(stderr, "x- Setting %s must be between %d and %d\n", key, k->min, k->max);
+			return -1;
+		}
+
+		*(int*)((char*)cfg + k->offset) = (int)v;
+		return 0;
+	}
+
+	fprintf(stderr, "x- Unknown setting '%s'\n", key);
+	return -1;
+}
+
+/*
+ Parses a "setting=value" string and applies it
+
+ @param cfg The configuration to change
+ @param str The setting string
+
+ @returns 0 on success, or -1 on failure
+*/
+static int config_parse_line(struct proxy_config* cfg, char* str) {
+	char* eq = strchr(str, '=');
+
+	if(!eq) {
+		fprintf(stderr, "x- Expected setting=value, got '%s'\n", str);
+		return -1;
+	}
+	*eq = '\0';
+
+	return config_set(cfg, trim(str), trim(eq + 1));
+}
+
+/*
+ Reads settings from a configuration file. Each line holds one
+ "setting = value" pair, blank lines and lines starting with '#' are skipped.
+
+ @param cfg The configuration to change
+ @param path The file to read
+
+ @returns 0 on success, or -1 on failure
+*/
+static int config_load(struct proxy_config* cfg, const char* path) {
+	char line[MAX_CONFIG_LINE];
+	char* str;
+	int lineno = 0, err = 0;
+	FILE* file = fopen(path, "r");
+
+	if(!file) {
+		fprintf(stderr, "x- Couldn't open configuration file %s\n", path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), file)) {
+		lineno++;
+		str = trim(line);
+		if(*str == '\0' || *str == '#') continue;
+
+		if(config_parse_line(cfg, str)) {
+			fprintf(stderr, "x- Error in %s on line %d\n", path, lineno);
+			err = -1;
+		}
+	}
+
+	fclose(file);
+	return err;
+}
+
+/*
+ Builds a full configuration: the defaults, then the configuration file,
+ then the command line overrides.
+
+ @param cfg The configuration to build
+
+ @returns 0 on success, or -1 if any setting was invalid
+*/
+static int config_build(struct proxy_config* cfg) {
+	char arg[MAX_CONFIG_LINE];
+	int i;
+
+	config_defaults(cfg);
+
+	if(config_path && config_load(cfg, config_path)) return -1;
+
+	for(i = 0; i < config_argc; i++) {
+		strncpy(arg, config_argv[i], MAX_CONFIG_LINE - 1);
+		arg[MAX_CONFIG_LINE - 1] = '\0';
+		if(config_parse_line(cfg, arg)) return -1;
+	}
+
+	// Make sure the request store is large enough to store a request
+	if(cfg->recv_size > cfg->request_size) {
+		fprintf(stderr, "x- recv_size must not be larger than request_size\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ Reads the configuration for the first time. Takes the command line
+ arguments that follow the port number: "-c <file>" picks the configuration
+ file (CONFIG_FILE is used if it exists otherwise), and any number of
+ "setting=value" arguments override the file.
+
+ @param argc Number of arguments
+ @param argv The arguments
+
+ @returns 0 on success, or -1 on failure
+*/
+int config_init(int argc, const char* argv[]) {
+	struct proxy_config cfg;
+	int i;
+
+	config_argv = (const char**)calloc(sizeof(char*), argc + 1); // One spare so argc may be 0
+	config_argc = 0;
+
+	for(i = 0; i < argc; i++) {
+		if(!strcmp(argv[i], "-c")) {
+			if(i + 1 >= argc) {
+				fprintf(stderr, "x- -c needs a configuration file\n");
+				return -1;
+			}
+			config_path = argv[++i];
+		}
+		else config_argv[config_argc++] = argv[i];
+	}
+
+	if(!config_path && access(CONFIG_FILE, F_OK) != -1) config_path = CONFIG_FILE;
+
+	if(config_build(&cfg)) return -1;
+
+	pthread_mutex_lock(&proxy_config_mutex);
+	proxy_config = cfg;
+	pthread_mutex_unlock(&proxy_config_mutex);
+
+	return 0;
+}
+
+/*
+ Re-reads the configuration file and command line overrides. If anything is
+ invalid the settings in use are left untouched.
+
+ @returns 0 on success, or -1 on failure
+*/
+int config_reload(void) {
+	struct proxy_config cfg;
+
+	if(config_build(&cfg)) return -1;
+
+	pthread_mutex_lock(&proxy_config_mutex);
+	proxy_config = cfg;
+	pthread_mutex_unlock(&proxy_config_mutex);
+
+	return 0;
+}
+
+/*
+ Takes a copy of the settings currently in use
+
+ @param cfg Filled with the settings
+*/
+void config_get(struct proxy_config* cfg) {
+	pthread_mutex_lock(&proxy_config_mutex);
+	*cfg = proxy_config;
+	pthread_mutex_unlock(&proxy_config_mutex);
+}
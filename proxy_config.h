@@ -0,0 +1,34 @@
+
+#ifndef proxy_proxy_config_h
+#define proxy_proxy_config_h
+
+#define CONFIG_FILE "proxy.conf"
+#define MAX_CONFIG_LINE 256
+
+struct proxy_config {
+	int backlog; // Connections waiting to be accepted
+	int recv_size; // Bytes read per recv() call
+	int request_size; // Largest request accepted from a client
+	int threads; // Worker threads running get_and_send()
+	int max_file_size; // Largest response kept in memory
+	int debug; // Turns on assertions
+	int verbose; // Turns on per-request progress messages
+	int per_origin; // Requests in flight to a single origin
+	int origin_queue; // Requests queued on a single origin
+	int breaker_threshold; // Consecutive failures that open an origin's breaker
+	int breaker_cooldown; // Seconds an open breaker rejects requests for
+	int upstream_timeout; // Seconds to wait on a webserver, 0 waits forever
+	int client_timeout; // Seconds to wait for a client's request, 0 waits forever
+	int cache_size; // Bytes of responses the cache may hold
+	int cache_ttl; // Seconds a cached response without max-age or Expires stays fresh, 0 keeps it until evicted
+	char warmup_file[MAX_CONFIG_LINE]; // Access log or hostname list to fill the cache from at startup
+	int warmup_rate; // Warmup and prefetch fetches per second
+	int prefetch; // Fetches pages linked from HTML responses ahead of time
+	int prefetch_links; // Most links prefetched from one page
+};
+
+int config_init(int argc, const char* argv[]);
+int config_reload(void);
+void config_get(struct proxy_config* cfg);
+
+#endif
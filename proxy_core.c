@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -13,6 +14,10 @@
 #include "proxy_core.h"
 #include "proxy_def.h"
 #include "proxy_log.h"
+#include "proxy_trace.h"
+#include "proxy_config.h"
+#include "proxy_cache.h"
+#include "proxy_warm.h"
 
 pthread_mutex_t proxy_log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -84,45 +89,37 @@ int has_req_end(char* req) {
 }
 
 /*
- Retrieves a file from a webserver and sends the response through a socket
+ Hashes a string (djb2)
  
- @param ptr A pointer to a request structure
+ @param str The string
  
- @returns 0 on success
+ @returns The hash of the string
 */
-void* get_and_send(void* ptr) {
-	// Cast argument
-	rb req = (rb)ptr;
+unsigned long hash_string(const char* str) {
+	unsigned long hash = 5381;
+	int c;
 	
-	//////////////////////////////////
-	// Check if the socket is valid //
-	//////////////////////////////////
-	if(req->sock <= 0) {
-		fprintf(stderr, "x- Error for client %s: Socket invalid or does not exist\n", req->ip);
-		send(req->sock, ERR_500, strlen(ERR_500), 0);
-		close(req->sock);
-		pthread_exit(0);
-	}
-	//////////////////////////////////
-	//////////////////////////////////
+	while((c = *str++)) hash = ((hash << 5) + hash) + c;
 	
-	int socketDescriptor = 0; // Socket to send/receive with the webserver
-	struct sockaddr_in *server_addr; // Will be used to store the socket information for the webserver
+	return hash;
+}
+
+/*
+ Looks up a webserver and connects a socket to it on port 80
+ 
+ @param hostname The hostname of the webserver
+ @param client The client the connection is for, used in error messages
+ @param cfg The settings currently in use
+ @param req_id The id of the request, used to trace it, or 0 if there is no request
+ 
+ @returns The connected socket, or -1 on failure
+*/
+static int connect_origin(const char* hostname, const char* client, struct proxy_config* cfg, unsigned long req_id) {
+	int socketDescriptor = -1; // Socket to send/receive with the webserver
 	struct addrinfo hints, // Hints struct for getaddrinfo()
 	*server_addr_info, // Contains list of bindable addresses filled by getaddrinfo()
 	*p; //used to iterate through the available addresses in server_addr_info
-	char request[GET_REQ_SIZE + NULL_CHAR + strlen(req->hostname)]; // Stores the GET request string
 	int returnv; // Used to contain the return value of getaddrinfo()
-	char ip4_address[IP4_LEN]; // Stores string version of IPv4 address
-	char ip6_address[IP6_LEN]; // Stores string version of IPv6 address
-	char* ip_address; // Will point to either of the above IP strings
-	
-	///////////////////////////////////////////////////
-	// Form the GET request to send to the webserver //
-	///////////////////////////////////////////////////
-	sprintf(request, "GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n", req->file, req->hostname);
-	///////////////////////////////////////////////////
-	///////////////////////////////////////////////////
 	
 	//////////////////////////////////////////
 	// Zero the hints structure and fill it //
@@ -138,35 +135,14 @@ void* get_and_send(void* ptr) {
 	// Lookup a bunch of valid IP and port numbers on the //
 	// target webserver to connect to using HTTP.         //
 	////////////////////////////////////////////////////////
-	if( (returnv = getaddrinfo(req->hostname, "80", &hints, &server_addr_info)) != 0) {
-		fprintf(stderr, "x- Error with hostname '%s' for client %s: %s\n", req->hostname, req->ip, gai_strerror(returnv));
-		close(req->sock);
-		free(req->file);
-		free(req->hostname);
-		free(req->ip);
-		free(req);
-		pthread_exit(0);
+	if( (returnv = getaddrinfo(hostname, "80", &hints, &server_addr_info)) != 0) {
+		fprintf(stderr, "x- Error with hostname '%s' for client %s: %s\n", hostname, client, gai_strerror(returnv));
+		return -1;
 	}
 	////////////////////////////////////////////////////////
 	////////////////////////////////////////////////////////
 	
-	// Free our hints structure
-	freeaddrinfo(&hints);
-	
-	/////////////////////////////////////////
-	// Get the IP address of the webserver //
-	/////////////////////////////////////////
-	for (p = server_addr_info; p != NULL; p = p->ai_next) {
-		server_addr = (struct sockaddr_in*) p->ai_addr;
-		
-		if(p->ai_family == AF_INET) ip_address = ip4_address;
-		else if(p->ai_family == AF_INET6) ip_address = ip6_address;
-		else continue;
-		
-		strcpy(ip_address, inet_ntoa(server_addr->sin_addr));
-	}
-	/////////////////////////////////////////
-	/////////////////////////////////////////
+	if(req_id) trace_event(req_id, TRACE_RESOLVED);
 	
 	/////////////////////////////////////////////////////
 	// Find an IP to bind a socket to on the webserver //
@@ -179,6 +155,13 @@ void* get_and_send(void* ptr) {
 			continue;
 		}
 		
+		if(cfg->upstream_timeout > 0) {
+			// Give up on a webserver that stalls, SO_SNDTIMEO also bounds connect()
+			struct timeval tv = { cfg->upstream_timeout, 0 };
+			setsockopt(socketDescriptor, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(socketDescriptor, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		}
+		
 		if (connect(socketDescriptor, p->ai_addr, p->ai_addrlen) < 0) {
 			// Cant connect to the given address using the socket
 			close(socketDescriptor);
@@ -194,57 +177,253 @@ void* get_and_send(void* ptr) {
 	// Free the server address info structure
 	freeaddrinfo(server_addr_info);
 	
+	if(p == NULL) {
+		// Couldn't connect to any of the webserver's addresses
+		printf("x- Couldn't connect to %s for client %s. Host unreachable.\n", hostname, client);
+		return -1;
+	}
+	
+	if(req_id) trace_event(req_id, TRACE_CONNECTED);
+	return socketDescriptor;
+}
+
+/*
+ Appends a chunk of a response to the copy being collected for the cache.
+ Gives up on the copy once it grows past max_file_size.
+ 
+ @param fill Pointer to the copy, set to NULL when giving up
+ @param fill_len Length of the copy in bytes
+ @param fill_cap Bytes allocated for the copy
+ @param chunk The chunk to append
+ @param len Length of the chunk in bytes
+ @param max_file_size Largest copy to keep
+*/
+static void fill_append(char** fill, long* fill_len, long* fill_cap, const char* chunk, long len, long max_file_size) {
+	char* grown;
+	
+	if(!*fill) return;
+	
+	if(*fill_len + len > max_file_size) {
+		// Too big to cache
+		free(*fill);
+		*fill = NULL;
+		return;
+	}
+	
+	if(*fill_len + len > *fill_cap) {
+		while(*fill_len + len > *fill_cap) *fill_cap *= 2;
+		if(!(grown = (char*)realloc(*fill, *fill_cap))) {
+			free(*fill);
+			*fill = NULL;
+			return;
+		}
+		*fill = grown;
+	}
+	
+	memcpy(*fill + *fill_len, chunk, len);
+	*fill_len += len;
+}
+
+/*
+ Fetches a file from a webserver straight into the cache, without a client.
+ Used to warm the cache ahead of requests. Nobody is waiting on the
+ response, so the webserver gets at most WARM_TIMEOUT seconds to answer.
+ 
+ @param hostname The hostname of the webserver
+ @param file The file to fetch
+ 
+ @returns 0 if the response was cached, or -1 otherwise
+*/
+int cache_fill(const char* hostname, const char* file) {
+	struct proxy_config cfg; // Copy of the settings currently in use
+	char request[GET_REQ_SIZE + NULL_CHAR + strlen(file) + strlen(hostname)]; // Stores the GET request string
+	char key[strlen(hostname) + strlen(file) + 2]; // Cache key of the response
+	long bytes_returned, fill_len = 0, fill_cap = FILL_START_SIZE, lifetime;
+	char* fill;
+	int socketDescriptor;
+	
+	config_get(&cfg);
+	if(!cfg.upstream_timeout || cfg.upstream_timeout > WARM_TIMEOUT) cfg.upstream_timeout = WARM_TIMEOUT;
+	sprintf(request, "GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n", file, hostname);
+	sprintf(key, "%s/%s", hostname, file);
+	
+	char rbuffer[cfg.recv_size]; // The buffer to store the recv()'d bytes in
+	
+	if((socketDescriptor = connect_origin(hostname, "warmup", &cfg, 0)) < 0) return -1;
+	
+	if(send(socketDescriptor, request, strlen(request), 0) < 0 || !(fill = (char*)malloc(fill_cap))) {
+		close(socketDescriptor);
+		return -1;
+	}
+	
+	while((bytes_returned = recv(socketDescriptor, rbuffer, cfg.recv_size, 0)) > 0) {
+		fill_append(&fill, &fill_len, &fill_cap, rbuffer, bytes_returned, cfg.max_file_size);
+		if(!fill) break;
+	}
+	close(socketDescriptor);
+	
+	if(bytes_returned < 0 || !fill || !cache_cacheable(fill, fill_len, &lifetime)) {
+		free(fill);
+		return -1;
+	}
+	
+	cache_insert(key, fill, fill_len, lifetime);
+	return 0;
+}
+
+/*
+ Retrieves a file from a webserver and sends the response through a socket.
+ Requests sched_submit() found in the cache are answered from it, other
+ responses are cached. The request structure is freed before returning.
+ 
+ @param req A pointer to a request structure
+ 
+ @returns GS_OK on success, GS_ORIGIN_ERR if the webserver could not be reached, or GS_CLIENT_ERR if the client could not be served
+*/
+int get_and_send(rb req) {
+	struct proxy_config cfg; // Copy of the settings currently in use
+	config_get(&cfg);
+	
+	//////////////////////////////////
+	// Check if the socket is valid //
+	//////////////////////////////////
+	if(req->sock <= 0) {
+		fprintf(stderr, "x- Error for client %s: Socket invalid or does not exist\n", req->ip);
+		send(req->sock, ERR_500, strlen(ERR_500), 0);
+		close(req->sock);
+		if(req->cached) cache_release(req->cached);
+		trace_event(req->id, TRACE_DONE);
+		free(req->file);
+		free(req->hostname);
+		free(req->ip);
+		free(req);
+		return GS_CLIENT_ERR;
+	}
+	//////////////////////////////////
+	//////////////////////////////////
+	
+	int socketDescriptor = 0; // Socket to send/receive with the webserver
+	char request[GET_REQ_SIZE + NULL_CHAR + strlen(req->file) + strlen(req->hostname)]; // Stores the GET request string
+	char key[strlen(req->hostname) + strlen(req->file) + 2]; // Cache key of the response
+	struct cache_entry* cached = req->cached; // Cached copy of the response, found by sched_submit()
+	int sent; // Result of sending a cached response
+	
+	///////////////////////////////////////////////////
+	// Form the GET request to send to the webserver //
+	///////////////////////////////////////////////////
+	sprintf(request, "GET /%s HTTP/1.0\r\nHost: %s\r\n\r\n", req->file, req->hostname);
+	sprintf(key, "%s/%s", req->hostname, req->file);
+	///////////////////////////////////////////////////
+	///////////////////////////////////////////////////
+	
+	/////////////////////////////////////////////
+	// Serve the response from the cache if we //
+	// have a fresh copy of it.                //
+	/////////////////////////////////////////////
+	if(cached) {
+		trace_event(req->id, TRACE_CACHE_HIT);
+		if(cfg.verbose) printf("-- Serving %s from cache for client %s\n", req->hostname, req->ip);
+		sent = send(req->sock, cached->body, cached->len, 0) >= 0;
+		
+		pthread_mutex_lock(&proxy_log_mutex);
+		if(sent && !req->nolog) inlog(req->ip, req->port, (int)cached->len, req->hostname);
+		pthread_mutex_unlock(&proxy_log_mutex);
+		
+		cache_release(cached);
+		close(req->sock);
+		trace_event(req->id, TRACE_DONE);
+		free(req->file);
+		free(req->hostname);
+		free(req->ip);
+		free(req);
+		return sent ? GS_OK : GS_CLIENT_ERR;
+	}
+	/////////////////////////////////////////////
+	/////////////////////////////////////////////
+	
+	if((socketDescriptor = connect_origin(req->hostname, req->ip, &cfg, req->id)) < 0) {
+		send(req->sock, ERR_400, strlen(ERR_400), 0);
+		close(req->sock);
+		trace_event(req->id, TRACE_DONE);
+		free(req->file);
+		free(req->hostname);
+		free(req->ip);
+		free(req);
+		return GS_ORIGIN_ERR;
+	}
+	
 	///////////////////////////////////////////////
 	// Use this socket to get the file specified //
 	///////////////////////////////////////////////
-	printf("-- Sending request to %s for client %s\n", req->hostname, req->ip);
+	if(cfg.verbose) printf("-- Sending request to %s for client %s\n", req->hostname, req->ip);
     // Send a GET request to the webserver to get the file specified
 	send(socketDescriptor, request, strlen(request), 0);
-	printf("-- Receiving response from %s for client %s\n", req->hostname, req->ip);
+	if(cfg.verbose) printf("-- Receiving response from %s for client %s\n", req->hostname, req->ip);
 	
 	long int bytes_returned; // The total bytes returned by recv()
-	char rbuffer[MAX_RECV+1]; // The buffer to store the recv()'d bytes in
+	char rbuffer[cfg.recv_size+1]; // The buffer to store the recv()'d bytes in
 	int total_bytes_returned = 0; // The total size of the response in bytes
+	long fill_len = 0, fill_cap = FILL_START_SIZE; // Length and capacity of fill
+	long lifetime; // Seconds the response stays fresh in the cache
+	char* fill = (char*)malloc(fill_cap); // Copy of the response for the cache
 	
 	do {
 		// Reset the buffer
-		memset(rbuffer, 0, MAX_RECV+1);
+		memset(rbuffer, 0, cfg.recv_size+1);
 		// Receive response whole/part from webserver
-		bytes_returned = recv(socketDescriptor, rbuffer, MAX_RECV, 0);
-		total_bytes_returned += bytes_returned;
+		bytes_returned = recv(socketDescriptor, rbuffer, cfg.recv_size, 0);
+		if(bytes_returned > 0 && !total_bytes_returned) trace_event(req->id, TRACE_FIRST_BYTE);
 		
 		if(bytes_returned < 0) {
 			// Some sort of error with recv
-			close(socketDescriptor);
 			printf("x- Error contacting server at %s for client %s. Host unreachable.\n", req->hostname, req->ip);
 			send(req->sock, ERR_400, strlen(ERR_400), 0);
 			close(req->sock);
 			close(socketDescriptor);
+			trace_event(req->id, TRACE_DONE);
+			free(fill);
 			free(req->file);
 			free(req->hostname);
 			free(req->ip);
 			free(req);
-			pthread_exit(0);
+			return GS_ORIGIN_ERR;
 		}
 		
+		total_bytes_returned += bytes_returned;
+		fill_append(&fill, &fill_len, &fill_cap, rbuffer, bytes_returned, cfg.max_file_size);
+		
 		// Try forwarding data chunk to the client
-		if(send(req->sock, rbuffer, strlen(rbuffer), 0) < 0) {
+		if(send(req->sock, rbuffer, bytes_returned, 0) < 0) {
 			// Error sending data to client
 			printf("x- Send to client %s failed, data now invalid, closing connection\n", req->ip);
 			close(req->sock);
 			close(socketDescriptor);
+			trace_event(req->id, TRACE_DONE);
+			free(fill);
 			free(req->file);
 			free(req->hostname);
 			free(req->ip);
 			free(req);
-			pthread_exit(0);
+			return GS_CLIENT_ERR;
 		}
 		
 	} while (bytes_returned > 0);
 	///////////////////////////////////////////////
 	///////////////////////////////////////////////
 
-	printf("-- Forwarding response from %s to client %s\n", req->hostname, req->ip);
+	if(cfg.verbose) printf("-- Forwarding response from %s to client %s\n", req->hostname, req->ip);
+	
+	////////////////////////////////////////////////
+	// Keep a copy of the response for next time, //
+	// and queue up the pages it links to.        //
+	////////////////////////////////////////////////
+	if(fill && cache_cacheable(fill, fill_len, &lifetime)) {
+		if(cfg.prefetch) warm_scan_links(fill, fill_len, cfg.prefetch_links);
+		cache_insert(key, fill, fill_len, lifetime);
+	}
+	else free(fill);
+	////////////////////////////////////////////////
+	////////////////////////////////////////////////
 	
 	////////////////////////////
 	// Done. Log the transfer //
@@ -257,9 +436,10 @@ void* get_and_send(void* ptr) {
 	
 	close(req->sock);
 	close(socketDescriptor);
+	trace_event(req->id, TRACE_DONE);
 	free(req->file);
 	free(req->hostname);
 	free(req->ip);
 	free(req);
-	return 0;
+	return GS_OK;
 }
@@ -5,8 +5,10 @@
 #include "proxy_def.h"
 
 char* get_hostname(char* str);
-void* get_and_send(void* ptr);
+int get_and_send(rb req);
+int cache_fill(const char* hostname, const char* file);
 void *get_in_addr(sa_p sa);
 int has_req_end(char* req);
+unsigned long hash_string(const char* str);
 
 #endif
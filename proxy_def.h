@@ -7,17 +7,42 @@
 #define BASE_TEN 10
 #define MAX_REQUEST_SIZE 2048
 #define DEBUG_ON 1
+#define VERBOSE_ON 0
 #define MAX_PORT 65535
 #define GET_BODY_LEN 26
 #define IP4_LEN 16
 #define IP6_LEN 45
+#define MAX_HOSTNAME 255
 #define GET_REQ_SIZE 26
 #define NULL_CHAR 1
 #define MAX_FILE_SIZE 1048576
 #define INDEX_FILE ""
 #define MAX_THREADS 10
+#define THREADS_LIMIT 1024 // Largest worker pool the threads setting allows
+#define MAX_ORIGINS 64
+#define MAX_PER_ORIGIN 4
+#define MAX_ORIGIN_QUEUE 32
+#define ORIGIN_QUANTUM 1
+#define BREAKER_THRESHOLD 5
+#define BREAKER_COOLDOWN 30
+#define UPSTREAM_TIMEOUT 0
+#define CLIENT_TIMEOUT 0
+#define CACHE_SIZE 16777216
+#define CACHE_TTL 60
+#define FILL_START_SIZE 16384
+#define WARMUP_FILE ""
+#define WARMUP_RATE 10
+#define WARM_TIMEOUT 5 // Most seconds a warmup or prefetch fetch waits on a webserver
+#define PREFETCH_ON 0
+#define PREFETCH_LINKS 8
 #define ERR_500 "500: Proxy server error"
 #define ERR_400 "400: Host unreachable or invalid"
+#define ERR_503 "503: Origin unavailable, try again later"
+
+// Results of get_and_send(), used by the scheduler to drive the circuit breakers
+#define GS_OK 0
+#define GS_ORIGIN_ERR 1
+#define GS_CLIENT_ERR 2
 
 typedef struct addrinfo ai;
 typedef struct sockaddr_storage socket_address;
@@ -32,6 +57,9 @@ struct request_body {
 	int port;
 	char* ip;
 	int nolog;
+	unsigned long id;
+	struct cache_entry* cached; // Fresh cached response to serve, or NULL to go to the origin
+	struct request_body* next;
 };
 typedef struct request_body* rb;
 
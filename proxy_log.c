@@ -3,6 +3,7 @@
 #include <time.h>
 #include <pthread.h>
 #include "proxy_log.h"
+#include "proxy_config.h"
 #include <unistd.h>
 #include <string.h>
 
@@ -17,6 +18,7 @@
  @param hostname The hostname requested by the client
 */
 void inlog(const char* ip, int port, int bytes_sent, const char* hostname) {
+	struct proxy_config cfg;
 	FILE* proxy_log;
 	if(access("proxy.log", F_OK) != -1) proxy_log = fopen("proxy.log", "a");
 	else proxy_log = fopen("proxy.log", "w");
@@ -24,7 +26,8 @@ void inlog(const char* ip, int port, int bytes_sent, const char* hostname) {
 	if (!ip || !port || bytes_sent < 0 || !hostname) {
 		fprintf(stderr, "x- Error printing to log file: Invalid arguments (ip: %s, port: %d, bytes_sent: %d, hostname: %s)\n", ip, port, bytes_sent, hostname);
 	}
-	printf("-- Writing to log file for client %s...\n", ip);
+	config_get(&cfg);
+	if(cfg.verbose) printf("-- Writing to log file for client %s...\n", ip);
 	time_t timenow;
 	struct tm* time_info;
 	
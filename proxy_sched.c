@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include "proxy_sched.h"
+#include "proxy_core.h"
+#include "proxy_trace.h"
+#include "proxy_cache.h"
+#include "proxy_def.h"
+
+pthread_mutex_t proxy_sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t proxy_sched_cond = PTHREAD_COND_INITIALIZER;
+
+struct origin origins[MAX_ORIGINS]; // Table of upstream hosts we have seen recently
+int rr_cursor = 0; // The origin the round robin is currently serving
+rb hit_head = NULL; // Requests that can be answered from the cache
+rb hit_tail = NULL;
+int worker_count = 0; // Worker threads currently running
+int worker_target = 0; // Worker threads we want running
+int per_origin = MAX_PER_ORIGIN; // Requests in flight to a single origin
+int origin_queue = MAX_ORIGIN_QUEUE; // Requests queued on a single origin
+int breaker_threshold = BREAKER_THRESHOLD; // Consecutive failures that open a breaker
+int breaker_cooldown = BREAKER_COOLDOWN; // Seconds an open breaker rejects requests for
+
+/*
+ Checks whether an origin holds no state worth keeping, so its slot can be
+ reused. Failures are forgotten once the breaker's cooldown has passed, so
+ hosts that failed once and were never asked for again don't fill the table.
+
+ @param o The origin
+ @param now The current time
+
+ @returns 1 if the origin can be reclaimed, or 0 otherwise
+*/
+static int origin_is_idle(struct origin* o, time_t now) {
+	if(o->inflight || o->queued) return 0;
+	if(o->state == BREAKER_CLOSED && !o->failures) return 1;
+	if(o->state == BREAKER_OPEN) return now >= o->open_until;
+	return now - o->last_failure >= breaker_cooldown;
+}
+
+/*
+ Looks up the origin for a hostname, creating it if it does not exist.
+ When the table is full the least recently used origin with nothing in
+ flight or queued is replaced, so a table full of failing hosts can't lock
+ out healthy ones. Must be called with proxy_sched_mutex held.
+
+ @param hostname The hostname of the origin
+
+ @returns Pointer to the origin, or NULL if every origin has requests in flight or queued
+*/
+static struct origin* find_origin(const char* hostname) {
+	unsigned long hash = hash_string(hostname);
+	time_t now = time(NULL);
+	struct origin* spare = NULL; // First slot we could put a new origin in
+	struct origin* oldest = NULL; // Least recently used origin with no requests
+	int i;
+
+	for(i = 0; i < MAX_ORIGINS; i++) {
+		struct origin* o = &origins[i];
+
+		if(!o->used) {
+			if(!spare || spare->used) spare = o;
+			continue;
+		}
+		if(o->hash == hash && !strcmp(o->hostname, hostname)) {
+			o->last_used = now;
+			return o;
+		}
+		if(!spare && origin_is_idle(o, now)) spare = o;
+		if(!o->inflight && !o->queued && (!oldest || o->last_used < oldest->last_used)) oldest = o;
+	}
+
+	if(!spare) spare = oldest;
+	if(!spare) return NULL;
+
+	// Take over the slot
+	free(spare->hostname);
+	memset(spare, 0, sizeof(struct origin));
+	spare->hostname = (char*)calloc(sizeof(char), strlen(hostname) + NULL_CHAR);
+	strcpy(spare->hostname, hostname);
+	spare->hash = hash;
+	spare->used = 1;
+	spare->state = BREAKER_CLOSED;
+	spare->last_used = now;
+
+	return spare;
+}
+
+/*
+ Checks whether a worker may start a request for an origin right now
+
+ @param o The origin
+
+ @returns 1 if the head of the origin's queue can be dispatched, or 0 otherwise
+*/
+static int origin_is_runnable(struct origin* o) {
+	if(!o->used || !o->queued) return 0;
+	if(o->state == BREAKER_OPEN) return 0;
+	// Only a single probe request is let through a half open breaker
+	if(o->state == BREAKER_HALF_OPEN) return !o->inflight;
+	return o->inflight < per_origin;
+}
+
+/*
+ Fails a request straight back to the client without contacting the origin
+
+ @param req The request to reject
+*/
+static void reject_request(rb req) {
+	printf("x- Rejecting request from %s to %s, origin unavailable\n", req->ip, req->hostname);
+	send(req->sock, ERR_503, strlen(ERR_503), 0);
+	close(req->sock);
+	trace_event(req->id, TRACE_DONE);
+	free(req->file);
+	free(req->hostname);
+	free(req->ip);
+	free(req);
+}
+
+/*
+ Rejects every request in a list
+
+ @param list The first request in the list
+*/
+static void reject_all(rb list) {
+	rb next;
+
+	while(list) {
+		next = list->next;
+		reject_request(list);
+		list = next;
+	}
+}
+
+/*
+ Queues a request on its origin for the workers to pick up. Requests the
+ cache can answer skip the origin queues, so they are served even while
+ the origin's breaker is open and don't count towards its limits. Other
+ requests for origins with an open circuit breaker, or with a full queue,
+ are rejected immediately.
+
+ @param req The request to queue
+*/
+void sched_submit(rb req) {
+	struct origin* o;
+	char key[strlen(req->hostname) + strlen(req->file) + 2]; // Cache key of the response
+
+	req->next = NULL;
+
+	sprintf(key, "%s/%s", req->hostname, req->file);
+	req->cached = cache_get(key);
+
+	pthread_mutex_lock(&proxy_sched_mutex);
+	if(req->cached) {
+		if(hit_tail) hit_tail->next = req;
+		else hit_head = req;
+		hit_tail = req;
+
+		pthread_cond_signal(&proxy_sched_cond);
+		pthread_mutex_unlock(&proxy_sched_mutex);
+		return;
+	}
+
+	o = find_origin(req->hostname);
+
+	if(o && o->state == BREAKER_OPEN && time(NULL) >= o->open_until) {
+		// Cooldown is over, let a probe through
+		o->state = BREAKER_HALF_OPEN;
+	}
+
+	if(!o || o->state == BREAKER_OPEN || o->queued >= origin_queue) {
+		pthread_mutex_unlock(&proxy_sched_mutex);
+		reject_request(req);
+		return;
+	}
+
+	if(o->tail) o->tail->next = req;
+	else o->head = req;
+	o->tail = req;
+	o->queued++;
+
+	pthread_cond_signal(&proxy_sched_cond);
+	pthread_mutex_unlock(&proxy_sched_mutex);
+}
+
+/*
+ Checks whether an origin is accepting requests, without adding it to the
+ table. Used by the warmup thread so it leaves failing origins alone.
+
+ @param hostname The hostname of the origin
+
+ @returns 1 if the origin's breaker is closed or the origin is unknown, or 0 otherwise
+*/
+int sched_origin_available(const char* hostname) {
+	unsigned long hash = hash_string(hostname);
+	int available = 1;
+	int i;
+
+	pthread_mutex_lock(&proxy_sched_mutex);
+	for(i = 0; i < MAX_ORIGINS; i++) {
+		struct origin* o = &origins[i];
+
+		if(o->used && o->hash == hash && !strcmp(o->hostname, hostname)) {
+			available = o->state == BREAKER_CLOSED;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&proxy_sched_mutex);
+
+	return available;
+}
+
+/*
+ Waits for the next request to run. Cache hits go first, as they never
+ wait on an origin. Origins are served by deficit round robin, so every
+ origin with work gets ORIGIN_QUANTUM requests per turn no matter how many
+ requests it has queued.
+
+ @param origin Set to the origin the request belongs to, or NULL for a cache hit
+
+ @returns The request to run, or NULL if the calling worker should exit
+*/
+static rb sched_next(struct origin** origin) {
+	struct origin* o;
+	rb req;
+	int scanned;
+
+	pthread_mutex_lock(&proxy_sched_mutex);
+	while(1) {
+		if(worker_count > worker_target) {
+			// The pool has been shrunk
+			worker_count--;
+			pthread_mutex_unlock(&proxy_sched_mutex);
+			return NULL;
+		}
+
+		if(hit_head) {
+			req = hit_head;
+			hit_head = req->next;
+			if(!hit_head) hit_tail = NULL;
+
+			pthread_mutex_unlock(&proxy_sched_mutex);
+			req->next = NULL;
+			trace_event(req->id, TRACE_DISPATCHED);
+			*origin = NULL;
+			return req;
+		}
+
+		for(scanned = 0; scanned < MAX_ORIGINS; scanned++) {
+			o = &origins[rr_cursor];
+
+			if(origin_is_runnable(o)) {
+				// Start of this origin's turn
+				if(o->deficit < 1) o->deficit += ORIGIN_QUANTUM;
+				o->deficit--;
+				if(o->deficit < 1) rr_cursor = (rr_cursor + 1) % MAX_ORIGINS;
+
+				req = o->head;
+				o->head = req->next;
+				if(!o->head) o->tail = NULL;
+				o->queued--;
+				o->inflight++;
+
+				pthread_mutex_unlock(&proxy_sched_mutex);
+				req->next = NULL;
+				trace_event(req->id, TRACE_DISPATCHED);
+				*origin = o;
+				return req;
+			}
+
+			// Origins with nothing to run don't keep their credit
+			o->deficit = 0;
+			rr_cursor = (rr_cursor + 1) % MAX_ORIGINS;
+		}
+
+		pthread_cond_wait(&proxy_sched_cond, &proxy_sched_mutex);
+	}
+}
+
+/*
+ Records the result of a request against its origin and updates the
+ origin's circuit breaker.
+
+ @param o The origin the request went to
+ @param result The value returned by get_and_send()
+*/
+static void sched_done(struct origin* o, int result) {
+	rb flushed = NULL; // Queued requests to reject if the breaker trips
+
+	pthread_mutex_lock(&proxy_sched_mutex);
+	o->inflight--;
+
+	if(result == GS_ORIGIN_ERR) {
+		o->failures++;
+		o->last_failure = time(NULL);
+
+		if(o->state == BREAKER_HALF_OPEN || o->failures >= breaker_threshold) {
+			printf("x- Origin %s keeps failing, rejecting its requests for %d seconds\n", o->hostname, breaker_cooldown);
+			o->state = BREAKER_OPEN;
+			o->open_until = time(NULL) + breaker_cooldown;
+			flushed = o->head;
+			o->head = o->tail = NULL;
+			o->queued = 0;
+		}
+	}
+	else if(result == GS_OK) {
+		o->failures = 0;
+		o->state = BREAKER_CLOSED;
+	}
+
+	// A slot on this origin has freed up
+	pthread_cond_broadcast(&proxy_sched_cond);
+	pthread_mutex_unlock(&proxy_sched_mutex);
+
+	reject_all(flushed);
+}
+
+/*
+ Worker thread body. Runs queued requests forever.
+
+ @param ptr Unused
+*/
+static void* sched_worker(void* ptr) {
+	struct origin* o;
+	rb req;
+	int result;
+
+	while((req = sched_next(&o))) {
+		result = get_and_send(req);
+		// Cache hits never reached the origin, so they say nothing about it
+		if(o) sched_done(o, result);
+	}
+
+	trace_release();
+	return 0;
+}
+
+/*
+ Applies the scheduler settings, starting or stopping worker threads until
+ the pool matches the configured size. Workers that are busy finish their
+ current request before stopping.
+
+ @param cfg The settings to apply
+*/
+void sched_configure(struct proxy_config* cfg) {
+	pthread_t thread;
+
+	pthread_mutex_lock(&proxy_sched_mutex);
+	per_origin = cfg->per_origin;
+	origin_queue = cfg->origin_queue;
+	breaker_threshold = cfg->breaker_threshold;
+	breaker_cooldown = cfg->breaker_cooldown;
+	worker_target = cfg->threads;
+
+	while(worker_count < worker_target) {
+		if(pthread_create(&thread, 0, sched_worker, NULL)) {
+			perror("pthread_create");
+			break;
+		}
+		pthread_detach(thread);
+		worker_count++;
+	}
+
+	// Wake idle workers so any extras exit, and so raised limits take effect
+	pthread_cond_broadcast(&proxy_sched_cond);
+	pthread_mutex_unlock(&proxy_sched_mutex);
+}
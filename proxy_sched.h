@@ -0,0 +1,33 @@
+
+#ifndef proxy_proxy_sched_h
+#define proxy_proxy_sched_h
+
+#include <time.h>
+#include "proxy_def.h"
+#include "proxy_config.h"
+
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+
+struct origin {
+	char* hostname;
+	unsigned long hash;
+	int used;
+	int inflight; // Requests to this origin currently held by a worker
+	int queued; // Requests waiting in this origin's queue
+	int deficit; // Deficit round robin credit
+	int failures; // Consecutive failed requests
+	int state; // Circuit breaker state
+	time_t open_until; // When an open breaker lets a probe through
+	time_t last_failure; // When the last request to this origin failed
+	time_t last_used; // When a request for this origin last arrived
+	rb head;
+	rb tail;
+};
+
+void sched_configure(struct proxy_config* cfg);
+void sched_submit(rb req);
+int sched_origin_available(const char* hostname);
+
+#endif
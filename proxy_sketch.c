@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include "proxy_sketch.h"
+
+/*
+ Spreads the bits of a key's hash so the block and counter indexes don't
+ depend on each other (splitmix64 finaliser)
+
+ @param hash The hash of the key
+
+ @returns The mixed hash
+*/
+static uint64_t sketch_mix(unsigned long hash) {
+	uint64_t x = (uint64_t)hash;
+
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x;
+}
+
+/*
+ Finds a key's block, and its counter in each row of the block. All of a
+ key's counters live in one 64 byte block, so each lookup touches a single
+ cache line.
+
+ @param sk The sketch
+ @param hash The hash of the key
+ @param counters Filled with pointers to the key's SKETCH_ROWS counters
+*/
+static void sketch_counters(struct sketch* sk, unsigned long hash, uint8_t** counters) {
+	uint64_t x = sketch_mix(hash);
+	uint8_t* block = (uint8_t*)sk->blocks[(x >> 32) % SKETCH_BLOCKS];
+	int i;
+
+	for(i = 0; i < SKETCH_ROWS; i++) counters[i] = &block[i * 16 + ((x >> (i * 4)) & 15)];
+}
+
+/*
+ Halves every counter so old popularity fades. Works on 8 counters at a
+ time, and the loop is simple enough for the compiler to vectorise.
+
+ @param sk The sketch
+*/
+static void sketch_age(struct sketch* sk) {
+	uint64_t* words = &sk->blocks[0][0];
+	int i;
+
+	for(i = 0; i < SKETCH_BLOCKS * 8; i++) words[i] = (words[i] >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+
+	sk->additions /= 2;
+}
+
+/*
+ Records an access to a key. Only the key's smallest counters are raised
+ (conservative update), which keeps collisions from inflating estimates.
+
+ @param sk The sketch
+ @param hash The hash of the key
+*/
+void sketch_increment(struct sketch* sk, unsigned long hash) {
+	uint8_t* counters[SKETCH_ROWS];
+	int i, min = SKETCH_MAX;
+
+	sketch_counters(sk, hash, counters);
+	for(i = 0; i < SKETCH_ROWS; i++) {
+		if(*counters[i] < min) min = *counters[i];
+	}
+	if(min == SKETCH_MAX) return;
+
+	for(i = 0; i < SKETCH_ROWS; i++) {
+		if(*counters[i] == min) (*counters[i])++;
+	}
+
+	if(++sk->additions >= SKETCH_SAMPLE) sketch_age(sk);
+}
+
+/*
+ Estimates how often a key has been accessed recently
+
+ @param sk The sketch
+ @param hash The hash of the key
+
+ @returns The estimated access count, at most SKETCH_MAX
+*/
+int sketch_estimate(struct sketch* sk, unsigned long hash) {
+	uint8_t* counters[SKETCH_ROWS];
+	int i, min = SKETCH_MAX;
+
+	sketch_counters(sk, hash, counters);
+	for(i = 0; i < SKETCH_ROWS; i++) {
+		if(*counters[i] < min) min = *counters[i];
+	}
+
+	return min;
+}
@@ -0,0 +1,20 @@
+
+#ifndef proxy_proxy_sketch_h
+#define proxy_proxy_sketch_h
+
+#include <stdint.h>
+
+#define SKETCH_BLOCKS 512 // 64 byte blocks, 32KB in all so the sketch stays in L1/L2
+#define SKETCH_ROWS 4 // Counters per key, one in each 16 counter row of its block
+#define SKETCH_MAX 15 // Counters saturate here, as 4 bit counters would
+#define SKETCH_SAMPLE 32768 // Increments between halving every counter
+
+struct sketch {
+	uint64_t blocks[SKETCH_BLOCKS][8] __attribute__((aligned(64))); // 64 one byte counters per block
+	long additions; // Increments since the counters were last halved
+};
+
+void sketch_increment(struct sketch* sk, unsigned long hash);
+int sketch_estimate(struct sketch* sk, unsigned long hash);
+
+#endif
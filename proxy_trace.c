@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "proxy_trace.h"
+
+struct trace_ring* trace_rings[MAX_TRACE_THREADS]; // Every thread's ring, in registration order
+int trace_ring_count = 0; // Number of rings handed out so far
+
+static __thread struct trace_ring* thread_ring = NULL; // The calling thread's ring
+static __thread int thread_untraced = 0; // Set when there were no rings left for the calling thread
+
+static const char* stage_names[] = {
+	"accept", "parsed", "dispatched", "cache hit", "resolved", "connected", "first byte", "done"
+};
+
+/*
+ Gets the calling thread's ring, registering a new one on first use
+
+ @returns The ring, or NULL if every ring is taken
+*/
+static struct trace_ring* get_ring(void) {
+	struct trace_ring* ring;
+	int tid, count, unused;
+
+	if(thread_ring || thread_untraced) return thread_ring;
+
+	// Take over the ring of a thread that has exited, if there is one
+	count = __atomic_load_n(&trace_ring_count, __ATOMIC_RELAXED);
+	if(count > MAX_TRACE_THREADS) count = MAX_TRACE_THREADS;
+	for(tid = 0; tid < count; tid++) {
+		ring = __atomic_load_n(&trace_rings[tid], __ATOMIC_ACQUIRE);
+		unused = 0;
+		if(ring && __atomic_compare_exchange_n(&ring->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			thread_ring = ring;
+			return thread_ring;
+		}
+	}
+
+	tid = __atomic_fetch_add(&trace_ring_count, 1, __ATOMIC_RELAXED);
+	if(tid >= MAX_TRACE_THREADS) {
+		// Only warn once, this thread never asks again
+		if(tid == MAX_TRACE_THREADS) fprintf(stderr, "x- Out of trace rings, requests on new threads won't be traced\n");
+		thread_untraced = 1;
+		return NULL;
+	}
+
+	thread_ring = (struct trace_ring*)calloc(1, sizeof(struct trace_ring));
+	if(!thread_ring) {
+		thread_untraced = 1;
+		return NULL;
+	}
+	thread_ring->tid = tid;
+	thread_ring->in_use = 1;
+	__atomic_store_n(&trace_rings[tid], thread_ring, __ATOMIC_RELEASE);
+
+	return thread_ring;
+}
+
+/*
+ Records a request reaching a stage. Only touches the calling thread's ring,
+ so it takes no locks and does no I/O.
+
+ @param req_id The id of the request
+ @param stage The TRACE_* stage reached
+*/
+void trace_event(unsigned long req_id, int stage) {
+	struct trace_ring* ring = get_ring();
+	struct trace_event* ev;
+	struct timespec now;
+
+	if(!ring) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// Make the previous head visible before this slot starts being overwritten
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	ev = &ring->events[ring->head % TRACE_RING_SIZE];
+	ev->req_id = req_id;
+	ev->ts = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+	ev->stage = stage;
+
+	// Publish the event to trace_dump()
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ Hands the calling thread's ring back so another thread can reuse it. Must be
+ called by threads that exit while the proxy keeps running.
+*/
+void trace_release(void) {
+	if(!thread_ring) return;
+
+	__atomic_store_n(&thread_ring->in_use, 0, __ATOMIC_RELEASE);
+	thread_ring = NULL;
+}
+
+/*
+ Writes the events still held in every ring to a file as Chrome trace-event
+ JSON. Each request shows up as one async slice from accept to done.
+
+ @param path The file to write to
+
+ @returns 0 on success, or -1 if the file could not be written
+*/
+int trace_dump(const char* path) {
+	struct trace_event* copy; // Snapshot of a ring, so writers aren't held up
+	unsigned long head, after, first, i;
+	int count, r, stage, comma = 0;
+	const char* phase;
+	FILE* out;
+
+	copy = (struct trace_event*)malloc(sizeof(struct trace_event) * TRACE_RING_SIZE);
+	if(!copy) return -1;
+
+	out = fopen(path, "w");
+	if(!out) {
+		free(copy);
+		return -1;
+	}
+
+	fprintf(out, "{\"traceEvents\":[\n");
+
+	count = __atomic_load_n(&trace_ring_count, __ATOMIC_RELAXED);
+	if(count > MAX_TRACE_THREADS) count = MAX_TRACE_THREADS;
+
+	for(r = 0; r < count; r++) {
+		struct trace_ring* ring = __atomic_load_n(&trace_rings[r], __ATOMIC_ACQUIRE);
+		if(!ring) continue;
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for(i = first; i < head; i++) copy[i % TRACE_RING_SIZE] = ring->events[i % TRACE_RING_SIZE];
+
+		// Anything the owner wrapped over while we were copying is torn, skip it.
+		// The fence keeps the copy above from being reordered after the load of after.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(after >= TRACE_RING_SIZE && after - TRACE_RING_SIZE + 1 > first) first = after - TRACE_RING_SIZE + 1;
+
+		for(i = first; i < head; i++) {
+			struct trace_event* ev = &copy[i % TRACE_RING_SIZE];
+
+			stage = ev->stage;
+			if(stage < TRACE_ACCEPT || stage > TRACE_DONE) continue;
+
+			if(stage == TRACE_ACCEPT) phase = "b";
+			else if(stage == TRACE_DONE) phase = "e";
+			else phase = "n";
+
+			fprintf(out, "%s{\"name\":\"request\",\"cat\":\"request\",\"ph\":\"%s\",\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,\"args\":{\"stage\":\"%s\"}}",
+					comma ? ",\n" : "", phase, ev->req_id, (int)getpid(), ring->tid, ev->ts / 1000, ev->ts % 1000, stage_names[stage]);
+			comma = 1;
+		}
+	}
+
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	free(copy);
+
+	return 0;
+}
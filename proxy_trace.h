@@ -0,0 +1,39 @@
+
+#ifndef proxy_proxy_trace_h
+#define proxy_proxy_trace_h
+
+#include "proxy_def.h"
+
+#define TRACE_RING_SIZE 4096
+// Enough rings for the largest worker pool, the main thread, and workers still finishing after a shrink
+#define MAX_TRACE_THREADS (THREADS_LIMIT * 2 + 1)
+#define TRACE_FILE "proxy_trace.json"
+
+// Request stages, in the order a request normally passes through them
+#define TRACE_ACCEPT 0
+#define TRACE_PARSED 1
+#define TRACE_DISPATCHED 2
+#define TRACE_CACHE_HIT 3
+#define TRACE_RESOLVED 4
+#define TRACE_CONNECTED 5
+#define TRACE_FIRST_BYTE 6
+#define TRACE_DONE 7
+
+struct trace_event {
+	unsigned long req_id;
+	long long ts; // CLOCK_MONOTONIC timestamp in nanoseconds
+	int stage;
+};
+
+struct trace_ring {
+	int tid; // Index of the ring, used as the thread id in dumps
+	int in_use; // Set while a thread owns the ring
+	unsigned long head; // Total events ever written to the ring
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+void trace_event(unsigned long req_id, int stage);
+void trace_release(void);
+int trace_dump(const char* path);
+
+#endif
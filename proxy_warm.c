@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "proxy_warm.h"
+#include "proxy_core.h"
+#include "proxy_cache.h"
+#include "proxy_sched.h"
+#include "proxy_config.h"
+#include "proxy_def.h"
+
+pthread_mutex_t proxy_warm_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t proxy_warm_cond = PTHREAD_COND_INITIALIZER;
+
+char* warm_queue[WARM_QUEUE_SIZE]; // Hostnames waiting to be prefetched
+int warm_head = 0; // Index of the next hostname to prefetch
+int warm_count = 0; // Number of hostnames in the queue
+
+struct warm_host {
+	char* hostname;
+	int count; // Times the hostname was requested
+};
+
+/*
+ Checks, ignoring case, whether a buffer starts with a string
+
+ @param str The buffer
+ @param len Bytes available in the buffer
+ @param prefix The string to look for
+
+ @returns 1 if the buffer starts with prefix, or 0 otherwise
+*/
+static int starts_with(const char* str, long len, const char* prefix) {
+	long i;
+
+	for(i = 0; prefix[i]; i++) {
+		if(i >= len || tolower((unsigned char)str[i]) != prefix[i]) return 0;
+	}
+
+	return 1;
+}
+
+/*
+ Turns a hostname or URL into the form get_hostname() gives requests, so
+ it matches their cache keys.
+
+ @param str The hostname or URL, changed in place
+
+ @returns Pointer to the hostname, or NULL if the proxy can't request it
+*/
+static char* warm_normalise(char* str) {
+	char* end;
+	int i;
+
+	while(isspace((unsigned char)*str)) str++;
+	end = str + strlen(str);
+	while(end > str && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+
+	for(i = 0; str[i]; i++) str[i] = tolower((unsigned char)str[i]);
+
+	if(end > str && end[-1] == '/') end[-1] = '\0';
+	if(!strncmp(str, "http://", 7)) str = &str[7];
+
+	// Only whole hosts on port 80 can be requested through the proxy
+	if(*str == '\0' || strpbrk(str, "/: ,")) return NULL;
+
+	return str;
+}
+
+/*
+ Fetches a hostname into the cache unless it is cached already or its
+ circuit breaker isn't closed, then waits long enough to keep to
+ warmup_rate.
+
+ @param hostname The hostname to fetch
+*/
+static void warm_fetch(const char* hostname) {
+	struct proxy_config cfg;
+	char key[strlen(hostname) + strlen(INDEX_FILE) + 2];
+	struct timespec delay;
+
+	sprintf(key, "%s/%s", hostname, INDEX_FILE);
+	if(cache_contains(key) || !sched_origin_available(hostname)) return;
+
+	config_get(&cfg);
+	if(cache_fill(hostname, INDEX_FILE) == 0 && cfg.verbose) printf("-- Warmed cache with %s\n", hostname);
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = 1000000000L / cfg.warmup_rate;
+	if(delay.tv_nsec >= 1000000000L) {
+		delay.tv_sec = 1;
+		delay.tv_nsec = 0;
+	}
+	nanosleep(&delay, NULL);
+}
+
+/*
+ Orders hosts by how often they were requested, most first
+*/
+static int warm_host_cmp(const void* a, const void* b) {
+	return ((const struct warm_host*)b)->count - ((const struct warm_host*)a)->count;
+}
+
+/*
+ Fills the cache from a recorded access log or a list of hostnames. Lines
+ in proxy.log format have the hostname as their last comma separated field,
+ any other line is taken as a hostname or URL. The most requested hosts are
+ fetched first.
+
+ @param path The file to replay
+*/
+static void warm_replay(const char* path) {
+	char line[MAX_REQUEST_SIZE];
+	struct warm_host* hosts; // Every distinct hostname seen
+	int* slots; // Open addressed index into hosts
+	int nhosts = 0, skipping = 0, i;
+	unsigned long h;
+	char* field;
+	FILE* file = fopen(path, "r");
+
+	if(!file) {
+		fprintf(stderr, "x- Couldn't open warmup file %s\n", path);
+		return;
+	}
+
+	hosts = (struct warm_host*)calloc(WARM_MAX_HOSTS, sizeof(struct warm_host));
+	slots = (int*)calloc(WARM_MAX_HOSTS * 2, sizeof(int));
+	if(!hosts || !slots) {
+		free(hosts);
+		free(slots);
+		fclose(file);
+		return;
+	}
+
+	while(fgets(line, sizeof(line), file)) {
+		// Ignore the rest of lines too long for the buffer
+		if(skipping) {
+			skipping = !strchr(line, '\n');
+			continue;
+		}
+		skipping = !strchr(line, '\n') && !feof(file);
+
+		field = strrchr(line, ',');
+		field = warm_normalise(field ? field + 1 : line);
+		if(!field) continue;
+
+		h = hash_string(field) % (WARM_MAX_HOSTS * 2);
+		while(slots[h] && strcmp(hosts[slots[h] - 1].hostname, field)) h = (h + 1) % (WARM_MAX_HOSTS * 2);
+
+		if(slots[h]) hosts[slots[h] - 1].count++;
+		else if(nhosts < WARM_MAX_HOSTS) {
+			hosts[nhosts].hostname = (char*)calloc(sizeof(char), strlen(field) + NULL_CHAR);
+			if(!hosts[nhosts].hostname) break;
+			strcpy(hosts[nhosts].hostname, field);
+			hosts[nhosts].count = 1;
+			slots[h] = ++nhosts;
+		}
+	}
+	fclose(file);
+	free(slots);
+
+	if(!nhosts) {
+		fprintf(stderr, "x- Warmup file %s has no hostnames to fetch, cache starts cold\n", path);
+		free(hosts);
+		return;
+	}
+
+	qsort(hosts, nhosts, sizeof(struct warm_host), warm_host_cmp);
+
+	printf("-- Warming cache with %d hosts from %s\n", nhosts, path);
+	for(i = 0; i < nhosts; i++) {
+		warm_fetch(hosts[i].hostname);
+		free(hosts[i].hostname);
+	}
+	printf("-- Cache warmup finished\n");
+
+	free(hosts);
+}
+
+/*
+ Warmup thread body. Replays the warmup file, then prefetches queued
+ hostnames forever.
+
+ @param ptr Unused
+*/
+static void* warm_thread(void* ptr) {
+	struct proxy_config cfg;
+	char* hostname;
+
+	config_get(&cfg);
+	if(cfg.warmup_file[0]) warm_replay(cfg.warmup_file);
+
+	while(1) {
+		pthread_mutex_lock(&proxy_warm_mutex);
+		while(!warm_count) pthread_cond_wait(&proxy_warm_cond, &proxy_warm_mutex);
+		hostname = warm_queue[warm_head];
+		warm_head = (warm_head + 1) % WARM_QUEUE_SIZE;
+		warm_count--;
+		pthread_mutex_unlock(&proxy_warm_mutex);
+
+		warm_fetch(hostname);
+		free(hostname);
+	}
+
+	return 0;
+}
+
+/*
+ Queues a hostname to be fetched into the cache. Hostnames already queued
+ are ignored, as is everything once the queue is full.
+
+ @param hostname The hostname
+*/
+void warm_enqueue(const char* hostname) {
+	char* copy;
+	int i;
+
+	pthread_mutex_lock(&proxy_warm_mutex);
+	if(warm_count == WARM_QUEUE_SIZE) {
+		pthread_mutex_unlock(&proxy_warm_mutex);
+		return;
+	}
+	for(i = 0; i < warm_count; i++) {
+		if(!strcmp(warm_queue[(warm_head + i) % WARM_QUEUE_SIZE], hostname)) {
+			pthread_mutex_unlock(&proxy_warm_mutex);
+			return;
+		}
+	}
+
+	copy = (char*)calloc(sizeof(char), strlen(hostname) + NULL_CHAR);
+	if(copy) {
+		strcpy(copy, hostname);
+		warm_queue[(warm_head + warm_count) % WARM_QUEUE_SIZE] = copy;
+		warm_count++;
+		pthread_cond_signal(&proxy_warm_cond);
+	}
+	pthread_mutex_unlock(&proxy_warm_mutex);
+}
+
+/*
+ Queues the pages an HTML response links to for prefetching. The proxy only
+ ever requests the root of a host, so only links of the form
+ "http://host" or "http://host/" are followed.
+
+ @param body The response, headers included
+ @param len Length of the response in bytes
+ @param max_links Most links to queue
+*/
+void warm_scan_links(const char* body, long len, int max_links) {
+	char hostname[MAX_HOSTNAME + NULL_CHAR];
+	long i, hdr_len, n, at;
+	int queued = 0, html = 0;
+	char c;
+
+	// Find the end of the headers, and check they say this is HTML
+	for(hdr_len = 0; hdr_len + 4 <= len; hdr_len++) {
+		if(!memcmp(&body[hdr_len], "\r\n\r\n", 4)) break;
+	}
+	if(hdr_len + 4 > len) return;
+	for(i = 0; i < hdr_len && !html; i++) html = starts_with(&body[i], hdr_len - i, "text/html");
+	if(!html) return;
+
+	for(i = hdr_len + 4; i < len && queued < max_links; i++) {
+		if(starts_with(&body[i], len - i, "href=")) at = i + 5;
+		else if(starts_with(&body[i], len - i, "src=")) at = i + 4;
+		else continue;
+
+		if(at < len && (body[at] == '"' || body[at] == '\'')) at++;
+		if(!starts_with(&body[at], len - at, "http://")) continue;
+		at += 7;
+
+		for(n = 0; at + n < len && n < MAX_HOSTNAME; n++) {
+			c = body[at + n];
+			if(!isalnum((unsigned char)c) && c != '.' && c != '-') break;
+			hostname[n] = tolower((unsigned char)c);
+		}
+		hostname[n] = '\0';
+		if(!n || at + n >= len || n == MAX_HOSTNAME) continue;
+
+		// Skip past an optional trailing '/', the link has to end there
+		at += n;
+		if(body[at] == '/') at++;
+		if(at < len && !strchr("\"' \t\r\n>", body[at])) continue;
+
+		warm_enqueue(hostname);
+		queued++;
+		i = at;
+	}
+}
+
+/*
+ Starts the thread that warms the cache
+*/
+void warm_init(void) {
+	pthread_t thread;
+
+	if(pthread_create(&thread, 0, warm_thread, NULL)) {
+		perror("pthread_create");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
@@ -0,0 +1,12 @@
+
+#ifndef proxy_proxy_warm_h
+#define proxy_proxy_warm_h
+
+#define WARM_QUEUE_SIZE 256
+#define WARM_MAX_HOSTS 4096
+
+void warm_init(void);
+void warm_enqueue(const char* hostname);
+void warm_scan_links(const char* body, long len, int max_links);
+
+#endif